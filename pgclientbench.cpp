@@ -0,0 +1,167 @@
+//
+//  pgclientbench.cpp
+//  pgclientlib
+//
+// MIT License
+//
+// Copyright (c) 2017 Timothy H. Keitt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+// Throughput and latency benchmark. Each client thread opens its own
+// session and runs the query repeatedly. Point it at a server directly and
+// then through pgproxy to compare the two. Transactions the server rejects
+// are counted separately and left out of the throughput and latencies.
+//
+// For point lookups, give a query with one int8 parameter, for example
+// -q 'SELECT * FROM t WHERE id = $1', and a range of ids with -r. Each
+// transaction draws an id at random; by default it is spliced into the
+// query text and sent as a simple query, and with -P the query is prepared
+// once and run from a bind_template with the id patched in.
+
+#include <random>
+#include <thread>
+#include <unistd.h>
+
+#include "pgclientlib.hpp"
+
+using namespace pgclientlib;
+using clock_type = std::chrono::steady_clock;
+
+int
+usage(const char* prog)
+{
+    std::cerr << "Usage: " << prog << " [-c clients] [-t transactions] [-q query] [-r id_range] [-P]"
+              << " [-h host] [-p port] [-s socket_dir] [-d database] [-U user]" << std::endl;
+    return 2;
+}
+
+int
+main(int argc, char* argv[])
+{
+    std::string host, port, dir = PGCLIENTLIB_SOCKET_DIR, database, query = "SELECT 1";
+    std::string user = std::getenv("USER") ? std::getenv("USER") : "postgres";
+    int clients = 1, transactions = 10000;
+    long long range = 100000;
+    bool prepared = false;
+    int c;
+    while ((c = getopt(argc, argv, "c:t:q:r:Ph:p:s:d:U:")) != -1)
+    {
+        switch (c)
+        {
+            case 'c': clients = std::max(1, std::atoi(optarg)); break;
+            case 't': transactions = std::max(1, std::atoi(optarg)); break;
+            case 'q': query = optarg; break;
+            case 'r': range = std::max(1LL, std::atoll(optarg)); break;
+            case 'P': prepared = true; break;
+            case 'h': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 's': dir = optarg; break;
+            case 'd': database = optarg; break;
+            case 'U': user = optarg; break;
+            default: return usage(argv[0]);
+        }
+    }
+    auto param = query.find("$1");
+    if (prepared && param == std::string::npos)
+    {
+        std::cerr << "-P needs a query with an int8 parameter $1" << std::endl;
+        return 2;
+    }
+    std::vector<std::vector<double>> latency(clients);
+    std::vector<std::string> errors(clients), first_failure(clients);
+    std::vector<std::size_t> failures(clients);
+    std::vector<std::thread> threads;
+    auto start = clock_type::now();
+    for (int i = 0; i != clients; ++i)
+    {
+        threads.emplace_back([&, i]
+        {
+            try
+            {
+                session s;
+                if (host.empty()) s.connect_local(port.empty() ? "5432" : port, dir);
+                else s.connect_tcp(host, port.empty() ? "postgresql" : port);
+                if (!s.startup(user, database))
+                    throw std::runtime_error("Server refused startup");
+                std::mt19937_64 gen(i);
+                std::uniform_int_distribution<long long> ids(1, range);
+                bind_template lookup("bench", {8});
+                if (prepared)
+                {
+                    s.parse("bench", query, {20});
+                    s.sync();
+                    if (!s.last_error().message.empty())
+                        throw std::runtime_error("Prepare failed: " + s.last_error().message);
+                }
+                auto& lat = latency[i];
+                lat.reserve(transactions);
+                for (int j = 0; j != transactions; ++j)
+                {
+                    auto t0 = clock_type::now();
+                    auto res = [&]
+                    {
+                        if (prepared)
+                        {
+                            lookup.set_int64(0, ids(gen));
+                            return s.try_execute_prepared(lookup);
+                        }
+                        if (param == std::string::npos) return s.try_query(query);
+                        auto q = query;
+                        q.replace(param, 2, std::to_string(ids(gen)));
+                        return s.try_query(q);
+                    }();
+                    s.clear_row_queue();
+                    s.clear_notification_queue();
+                    // Failed transactions are counted, not timed
+                    if (res) lat.push_back(std::chrono::duration<double>(clock_type::now() - t0).count());
+                    else if (!failures[i]++) first_failure[i] = res.error().message;
+                }
+            }
+            catch(const std::exception& e) { errors[i] = e.what(); }
+        });
+    }
+    for (auto&& t : threads) t.join();
+    std::chrono::duration<double> elapsed = clock_type::now() - start;
+    std::vector<double> all;
+    for (int i = 0; i != clients; ++i)
+    {
+        if (!errors[i].empty())
+            std::cerr << "client " << i << ": " << errors[i] << std::endl;
+        if (failures[i])
+            std::cerr << "client " << i << ": " << failures[i] << " transactions failed, first: "
+                      << first_failure[i] << std::endl;
+        all.insert(all.end(), latency[i].begin(), latency[i].end());
+    }
+    std::size_t failed = 0;
+    for (auto n : failures) failed += n;
+    if (all.empty()) return 1;
+    std::sort(all.begin(), all.end());
+    double sum = 0;
+    for (auto x : all) sum += x;
+    auto pct = [&](double p) { return 1e3 * all[std::min(all.size() - 1, std::size_t(p * all.size()))]; };
+    std::cout << all.size() << " transactions in " << elapsed.count() << " s\n"
+              << "failed: " << failed << "\n"
+              << "tps: " << all.size() / elapsed.count() << "\n"
+              << "latency ms: avg " << 1e3 * sum / all.size()
+              << ", p50 " << pct(0.5) << ", p99 " << pct(0.99)
+              << ", max " << 1e3 * all.back() << std::endl;
+    return 0;
+}
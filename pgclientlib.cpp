@@ -29,7 +29,17 @@
 //
 
 #include <sstream>
+#include <fstream>
 #include <iterator>
+#include <atomic>
+#include <limits>
+#include <thread>
+#include <chrono>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <boost/lexical_cast.hpp>
 
@@ -58,46 +68,841 @@ get_par(const std::vector<std::string>& t,
     return t[pos];
 }
 
+std::string
+default_user()
+{
+    if (const char* u = std::getenv("USER")) return u;
+    if (const char* u = getlogin()) return u;
+    return "postgres";
+}
+
 void print_notifications(session& s)
 {
     while (!s.notification_queue_empty())
         std::cout << s.get_notification() << std::endl;
 }
 
-void print_row(session& s)
+// Notices and notifications, then the tag of the command just completed
+void print_completion(session& s)
 {
-    switch(s.get_buffer_format())
+    print_notifications(s);
+    if (!s.last_command_tag().empty())
+        std::cout << s.last_command_tag() << std::endl;
+}
+
+/**
+ * Buffered result renderer. Rows are formatted into a large in-memory
+ * buffer that is written out in a single call when it fills up or when
+ * the command completes, instead of flushing once per row.
+ */
+class result_printer
+{
+public:
+    /**
+     * Output layout for query results.
+     */
+    enum struct output_format
+    {
+        aligned,   /**< Padded columns with a header line.      */
+        unaligned, /**< Fields separated by '|'.                */
+        csv,       /**< Comma-separated values (RFC 4180).      */
+        tsv        /**< Tab-separated values with COPY escaping. */
+    };
+
+    result_printer() { buf.reserve(buffer_size); }
+
+    result_printer(const result_printer&) = delete;
+    result_printer& operator=(const result_printer&) = delete;
+
+    ~result_printer()
+    {
+        try { redirect(""); }
+        catch(...) {}
+    }
+
+    void set_format(output_format f) { fmt = f; }      /**< Set the output layout. */
+    output_format get_format() const { return fmt; }   /**< Get the output layout. */
+    void begin_result() { header_done = false; }       /**< Print a header before the next row. */
+
+    /**
+     * Send output to a file. An empty path restores standard output.
+     */
+    void redirect(const std::string& path)
     {
-        case session::buffer_format::query:
+        flush();
+        if (out != stdout) std::fclose(out);
+        out = stdout;
+        if (path.empty()) return;
+        out = std::fopen(path.c_str(), "w");
+        if (!out)
         {
-            std::cout << "|";
-            for (auto&& r : s.get_strings())
-                std::cout << r << "|";
-            std::cout << std::endl;
-            break;
+            out = stdout;
+            throw std::runtime_error("Could not open output file " + path);
         }
-        case session::buffer_format::copy_text:
+    }
+
+    bool redirected() const { return out != stdout; } /**< True if writing to a file. */
+
+    /**
+     * Print up to max_rows rows from the session row queue (all rows if
+     * max_rows is zero). Returns the number of rows printed.
+     */
+    std::size_t print_rows(session& s, std::size_t max_rows)
+    {
+        std::size_t n = 0;
+        if (s.row_queue_empty()) return n;
+        auto more = [&]{ return !s.row_queue_empty() && (!max_rows || n != max_rows); };
+        switch(s.get_buffer_format())
         {
-            auto r = s.get_raw_row();
-            std::cout << std::string(r.begin(), r.end());
-            break;
+            case session::buffer_format::query:
+            {
+                if (fmt == output_format::aligned)
+                {
+                    std::vector<session::row_type> page;
+                    for (; more(); ++n) page.push_back(s.get_strings());
+                    print_aligned(s, page);
+                    break;
+                }
+                if (!header_done)
+                {
+                    session::row_type names;
+                    auto fd = s.field_descriptors();
+                    for (; fd.first != fd.second; ++fd.first)
+                        names.push_back(fd.first->first);
+                    print_record(names);
+                    header_done = true;
+                }
+                for (; more(); ++n) print_record(s.get_strings());
+                break;
+            }
+            case session::buffer_format::copy_text:
+            {
+                for (; more(); ++n)
+                {
+                    auto r = s.get_raw_row();
+                    put(reinterpret_cast<const char*>(r.data()), r.size());
+                }
+                break;
+            }
+            case session::buffer_format::copy_binary:
+            {
+                for (; more(); ++n)
+                {
+                    put(s.get_strings().front());
+                    put('\n');
+                }
+                break;
+            }
+            default: put("Unknown buffer format\n");
         }
-        case session::buffer_format::copy_binary:
+        return n;
+    }
+
+    /**
+     * Write out buffered text.
+     */
+    void flush()
+    {
+        if (!buf.empty()) std::fwrite(buf.data(), 1, buf.size(), out);
+        buf.clear();
+        std::fflush(out);
+    }
+
+private:
+    void put(char c)
+    {
+        buf.push_back(c);
+        if (buf.size() >= buffer_size) flush();
+    }
+
+    void put(const char* p, std::size_t n)
+    {
+        buf.append(p, n);
+        if (buf.size() >= buffer_size) flush();
+    }
+
+    void put(const std::string& x) { put(x.data(), x.size()); }
+
+    void pad(std::size_t n) { buf.append(n, ' '); }
+
+    // Display width, counting UTF-8 code points rather than bytes
+    static std::size_t width(const std::string& x)
+    {
+        return std::count_if(x.begin(), x.end(), [](char c)
+                             {
+                                 return (c & 0xC0) != 0x80;
+                             });
+    }
+
+    // Column widths are set by the first page of a result, so the pages
+    // of a streamed result line up under a single header; wider values
+    // on later pages overflow their column
+    void print_aligned(session& s, const std::vector<session::row_type>& page)
+    {
+        if (!header_done)
         {
-            std::cout << s.get_strings().front() << std::endl;
+            session::row_type names;
+            auto fd = s.field_descriptors();
+            for (; fd.first != fd.second; ++fd.first)
+                names.push_back(fd.first->first);
+            widths.assign(names.size(), 0);
+            for (std::size_t j = 0; j != names.size(); ++j)
+                widths[j] = width(names[j]);
+            for (auto&& r : page)
+                for (std::size_t j = 0; j < r.size() && j < widths.size(); ++j)
+                    widths[j] = std::max(widths[j], width(r[j]));
+            print_line(names);
+            for (std::size_t j = 0; j != widths.size(); ++j)
+            {
+                if (j) put('+');
+                buf.append(widths[j] + 2, '-');
+            }
+            put('\n');
+            header_done = true;
+        }
+        for (auto&& r : page) print_line(r);
+    }
+
+    void print_line(const session::row_type& r)
+    {
+        for (std::size_t j = 0; j != widths.size(); ++j)
+        {
+            const std::string& x = j < r.size() ? r[j] : std::string();
+            put(j ? " | " : " ");
+            put(x);
+            auto n = width(x);
+            if (j + 1 != widths.size() && n < widths[j]) pad(widths[j] - n);
+        }
+        put('\n');
+    }
+
+    void print_record(const session::row_type& r)
+    {
+        for (std::size_t j = 0; j != r.size(); ++j)
+        {
+            switch (fmt)
+            {
+                case output_format::csv:
+                {
+                    if (j) put(',');
+                    put_csv(r[j]);
+                    break;
+                }
+                case output_format::tsv:
+                {
+                    if (j) put('\t');
+                    put_tsv(r[j]);
+                    break;
+                }
+                default:
+                {
+                    if (j) put('|');
+                    put(r[j]);
+                }
+            }
+        }
+        put('\n');
+    }
+
+    void put_csv(const std::string& x)
+    {
+        if (x.find_first_of(",\"\r\n") == std::string::npos)
+        {
+            put(x);
+            return;
+        }
+        put('"');
+        for (char c : x)
+        {
+            if (c == '"') put('"');
+            put(c);
+        }
+        put('"');
+    }
+
+    void put_tsv(const std::string& x)
+    {
+        for (char c : x)
+        {
+            switch (c)
+            {
+                case '\\': put("\\\\"); break;
+                case '\t': put("\\t"); break;
+                case '\n': put("\\n"); break;
+                case '\r': put("\\r"); break;
+                default: put(c);
+            }
+        }
+    }
+
+    static const std::size_t buffer_size = 1 << 20;
+    std::string buf;
+    std::FILE* out = stdout;
+    output_format fmt = output_format::aligned;
+    bool header_done = false;
+    std::vector<std::size_t> widths; // of aligned columns, from the first page
+};
+
+/**
+ * Forwards Ctrl-C to the server as a cancel request while a query is
+ * running. Signals are waited for on a separate thread, so the request goes
+ * out even while the main thread is blocked reading replies. SIGINT is
+ * blocked in the constructing thread so that blocking reads there are not
+ * interrupted.
+ */
+class interrupt_handler
+{
+public:
+    explicit interrupt_handler(session& s)
+        : s(s), signals(io_service, SIGINT)
+    {
+        wait();
+        worker = std::thread([this]{ io_service.run(); });
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &mask, &saved_mask);
+    }
+
+    interrupt_handler(const interrupt_handler&) = delete;
+    interrupt_handler& operator=(const interrupt_handler&) = delete;
+
+    ~interrupt_handler()
+    {
+        io_service.stop();
+        worker.join();
+        pthread_sigmask(SIG_SETMASK, &saved_mask, nullptr);
+    }
+
+    /**
+     * Note Ctrl-C while in scope and, unless told otherwise, cancel the
+     * running query.
+     */
+    struct guard
+    {
+        explicit guard(interrupt_handler& h, bool cancel = true) : h(h)
+        {
+            h.cancel_query = cancel;
+            h.was_interrupted = false;
+            h.active = true;
+        }
+        ~guard() { h.active = false; }
+        interrupt_handler& h;
+    };
+
+    /**
+     * True if Ctrl-C was pressed since the innermost guard was created.
+     */
+    bool interrupted() const { return was_interrupted; }
+
+private:
+    void wait()
+    {
+        signals.async_wait([this](const asio::error_code& ec, int)
+                           {
+                               if (ec) return;
+                               if (active)
+                               {
+                                   was_interrupted = true;
+                                   if (cancel_query)
+                                   {
+                                       try { s.cancel(); }
+                                       catch(...) {}
+                                   }
+                               }
+                               wait();
+                           });
+    }
+
+    session& s;
+    std::atomic<bool> active{false}, cancel_query{true}, was_interrupted{false};
+    asio::io_service io_service;
+    asio::signal_set signals;
+    std::thread worker;
+    sigset_t saved_mask;
+};
+
+/**
+ * Parsed form of \\copy target from|to 'file' [options].
+ */
+struct copy_command
+{
+    std::string target;  /**< Table, column list or (query).  */
+    bool from = true;    /**< True for FROM, false for TO.    */
+    std::string file;    /**< Local file path.                */
+    std::string options; /**< Trailing options, passed as is. */
+};
+
+copy_command
+parse_copy(const std::string& line)
+{
+    copy_command cmd;
+    std::size_t i = line.find_first_of(" \t");
+    if (i == std::string::npos)
+        throw std::runtime_error("Usage: \\copy table from|to 'file' [options]");
+    auto skip_space = [&]{ while (i < line.size() && std::isspace(line[i])) ++i; };
+    auto word = [&]
+    {
+        std::size_t b = i;
+        while (i < line.size() && !std::isspace(line[i])) ++i;
+        return line.substr(b, i - b);
+    };
+    // The target runs up to a from/to keyword outside parentheses and quotes
+    int depth = 0;
+    char quote = 0;
+    std::size_t b = i;
+    for (; i < line.size(); ++i)
+    {
+        char c = line[i];
+        if (quote) { if (c == quote) quote = 0; continue; }
+        if (c == '\'' || c == '"') { quote = c; continue; }
+        if (c == '(') ++depth;
+        if (c == ')') --depth;
+        if (depth || !std::isspace(c)) continue;
+        skip_space();
+        std::size_t k = i;
+        std::string w = word();
+        std::transform(w.begin(), w.end(), w.begin(), ::tolower);
+        if (w == "from" || w == "to")
+        {
+            cmd.target = line.substr(b, k - b);
+            cmd.from = w == "from";
             break;
         }
-        default: std::cout << "Uknown buffer format" << std::endl;
+        i = k - 1;
+    }
+    skip_space();
+    if (cmd.target.find_first_not_of(" \t") == std::string::npos || i == line.size())
+        throw std::runtime_error("Usage: \\copy table from|to 'file' [options]");
+    if (line[i] == '\'')
+    {
+        std::size_t e = line.find('\'', i + 1);
+        if (e == std::string::npos)
+            throw std::runtime_error("Unterminated file name in \\copy");
+        cmd.file = line.substr(i + 1, e - i - 1);
+        i = e + 1;
     }
+    else cmd.file = word();
+    skip_space();
+    cmd.options = line.substr(i);
+    while (!cmd.options.empty() && (cmd.options.back() == ';' || std::isspace(cmd.options.back())))
+        cmd.options.pop_back();
+    return cmd;
+}
+
+void print_throughput(std::size_t bytes,
+                      std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+    double mb = bytes / 1048576.0;
+    std::cout << std::fixed << std::setprecision(2) << mb << " MB in "
+              << dt.count() << " s (" << (dt.count() > 0 ? mb / dt.count() : 0)
+              << " MB/s)" << std::defaultfloat << std::endl;
 }
 
-int main()
+/**
+ * Stream a local file into COPY FROM STDIN. The file is mapped and sent in
+ * large CopyData messages straight from the mapping. Ctrl-C abandons the
+ * copy with CopyFail.
+ */
+void copy_from_file(session& s, const copy_command& cmd, interrupt_handler& interrupt)
 {
+    const std::size_t chunk = 1 << 18;
+    int fd = ::open(cmd.file.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Could not open " + cmd.file);
+    struct stat st;
+    if (::fstat(fd, &st) < 0)
+    {
+        ::close(fd);
+        throw std::runtime_error("Could not stat " + cmd.file);
+    }
+    std::size_t size = st.st_size;
+    void* map = nullptr;
+    if (size)
+    {
+        map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED)
+            throw std::runtime_error("Could not map " + cmd.file);
+        ::madvise(map, size, MADV_SEQUENTIAL);
+    }
+    else ::close(fd);
+    std::size_t sent = 0;
+    auto start = std::chrono::steady_clock::now();
+    try
+    {
+        s.query("COPY " + cmd.target + " FROM STDIN " + cmd.options);
+        if (s.get_state() == session::session_state::copy_in)
+        {
+            // The server is waiting for data, so there is nothing to cancel
+            interrupt_handler::guard g(interrupt, false);
+            auto data = static_cast<const char*>(map);
+            for (; sent < size && !interrupt.interrupted(); sent += std::min(chunk, size - sent))
+                s.copy_data(data + sent, std::min(chunk, size - sent));
+            if (interrupt.interrupted()) s.copy_fail("canceled by user");
+            else s.copy_done();
+        }
+    }
+    catch(...)
+    {
+        if (map) ::munmap(map, size);
+        throw;
+    }
+    if (map) ::munmap(map, size);
+    print_completion(s);
+    print_throughput(sent, start);
+}
+
+/**
+ * Stream COPY TO STDOUT into a local file as rows arrive, through a large
+ * stdio buffer.
+ */
+void copy_to_file(session& s, const copy_command& cmd, interrupt_handler& interrupt)
+{
+    std::FILE* f = std::fopen(cmd.file.c_str(), "w");
+    if (!f) throw std::runtime_error("Could not open " + cmd.file);
+    std::vector<char> iobuf(1 << 20);
+    std::setvbuf(f, iobuf.data(), _IOFBF, iobuf.size());
+    std::size_t bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    try
+    {
+        interrupt_handler::guard g(interrupt);
+        s.start_query("COPY " + cmd.target + " TO STDOUT " + cmd.options);
+        bool more = true;
+        while (more)
+        {
+            more = s.fetch(1024);
+            while (!s.row_queue_empty())
+            {
+                auto r = s.get_raw_row();
+                bytes += std::fwrite(r.data(), 1, r.size(), f);
+            }
+        }
+    }
+    catch(...)
+    {
+        std::fclose(f);
+        throw;
+    }
+    if (std::fclose(f))
+        throw std::runtime_error("Error writing " + cmd.file);
+    print_completion(s);
+    print_throughput(bytes, start);
+}
+
+/**
+ * Find the next SQL statement in a script. Quoted strings, quoted
+ * identifiers, dollar quoting and comments are skipped when looking for
+ * the terminating semicolon. A backslash meta-command at the start of a
+ * statement extends to the end of its line. Returns the position following the statement
+ * (npos at end of input); the statement is trimmed and left empty if only
+ * whitespace and comments remain.
+ *
+ * \param sql The script text.
+ * \param pos Position at which to start.
+ * \param stmt Receives the statement, without the semicolon.
+ */
+std::size_t
+next_statement(const std::string& sql, std::size_t pos, std::string& stmt)
+{
+    auto ident = [](char c) { return std::isalnum(c) || c == '_' || (c & 0x80); };
+    std::size_t n = sql.size(), i = pos;
+    std::size_t first = std::string::npos, last = pos;
+    for (; i < n; ++i)
+    {
+        char c = sql[i];
+        if (std::isspace(c)) continue;
+        if (c == '-' && i + 1 < n && sql[i + 1] == '-')
+        {
+            i = sql.find('\n', i);
+            if (i == std::string::npos) i = n;
+            continue;
+        }
+        if (c == '/' && i + 1 < n && sql[i + 1] == '*')
+        {
+            int depth = 1;
+            for (i += 2; i < n && depth; ++i)
+            {
+                if (sql[i] == '*' && i + 1 < n && sql[i + 1] == '/') { --depth; ++i; }
+                else if (sql[i] == '/' && i + 1 < n && sql[i + 1] == '*') { ++depth; ++i; }
+            }
+            --i;
+            continue;
+        }
+        if (first == std::string::npos)
+        {
+            first = i;
+            if (c == '\\')
+            {
+                i = std::min(sql.find('\n', i), n);
+                last = i;
+                break;
+            }
+        }
+        if (c == ';') break;
+        if (c == '\'' || c == '"')
+        {
+            // E'' strings allow backslash escapes
+            bool esc = c == '\'' && i > 0 && (sql[i - 1] == 'E' || sql[i - 1] == 'e')
+                && (i < 2 || !ident(sql[i - 2]));
+            for (++i; i < n; ++i)
+            {
+                if (esc && sql[i] == '\\') { ++i; continue; }
+                if (sql[i] != c) continue;
+                if (i + 1 < n && sql[i + 1] == c) { ++i; continue; }
+                break;
+            }
+        }
+        else if (c == '$' && (i == 0 || !ident(sql[i - 1])))
+        {
+            std::size_t e = i + 1;
+            while (e < n && ident(sql[e]) && !(e == i + 1 && std::isdigit(sql[e]))) ++e;
+            if (e < n && sql[e] == '$')
+            {
+                std::string tag = sql.substr(i, e - i + 1);
+                e = sql.find(tag, e + 1);
+                i = e == std::string::npos ? n : e + tag.size() - 1;
+            }
+        }
+        last = std::min(i + 1, n);
+    }
+    stmt = first == std::string::npos ? "" : sql.substr(first, last - first);
+    return i < n ? i + 1 : std::string::npos;
+}
+
+bool
+is_copy_from_stdin(const std::string& stmt)
+{
+    auto t = tokenize(stmt);
+    auto lower = [](std::string x)
+    {
+        std::transform(x.begin(), x.end(), x.begin(), ::tolower);
+        return x;
+    };
+    if (t.empty() || lower(t[0]) != "copy") return false;
+    for (std::size_t i = 1; i + 1 < t.size(); ++i)
+        if (lower(t[i]) == "from" && lower(t[i + 1]).compare(0, 5, "stdin") == 0)
+            return true;
+    return false;
+}
+
+/**
+ * Options for non-interactive script execution.
+ */
+struct script_options
+{
+    bool stop_on_error = true; /**< Stop sending after the first error.  */
+    std::size_t depth = 100;   /**< Maximum statements in flight.       */
+    bool quiet = false;        /**< Do not print command tags.          */
+};
+
+/**
+ * Run a SQL script. Statements are sent pipelined, up to options.depth at
+ * a time, and their results collected in order. COPY FROM STDIN data
+ * following the statement in the script, terminated by a line containing
+ * only \\., is streamed to the server. With stop_on_error, no further
+ * statements are sent after an error, although those already in flight
+ * will still run (use a depth of one for strict behavior).
+ *
+ * Returns the number of statements that failed.
+ */
+std::size_t
+run_script(session& s, const std::string& sql,
+           const script_options& opts, result_printer& out)
+{
+    std::size_t pos = 0, count = 0, done = 0, failed = 0;
+    auto report = [&](bool ok)
+    {
+        ++done;
+        out.print_rows(s, 0);
+        out.flush();
+        if (ok && !opts.quiet) print_completion(s);
+        while (!ok && !s.notification_queue_empty())
+            std::cerr << "statement " << done << ": "
+                      << s.get_notification() << std::endl;
+        if (ok) s.clear_notification_queue();
+        else ++failed;
+    };
+    auto collect = [&]
+    {
+        out.begin_result();
+        report(s.pipeline_result());
+    };
+    auto start = std::chrono::steady_clock::now();
+    while (pos != std::string::npos && !(failed && opts.stop_on_error))
+    {
+        std::string stmt;
+        pos = next_statement(sql, pos, stmt);
+        if (stmt.empty()) continue;
+        if (stmt[0] == '\\')
+        {
+            std::cerr << "Ignoring meta-command " << tokenize(stmt)[0] << std::endl;
+            continue;
+        }
+        bool copy_in = is_copy_from_stdin(stmt);
+        while (s.pipeline_depth() >= (copy_in ? 1 : opts.depth)) collect();
+        if (failed && opts.stop_on_error) break;
+        ++count;
+        if (!copy_in)
+        {
+            s.pipeline_query(stmt);
+            continue;
+        }
+        // Inline data starts on the line after the statement
+        std::size_t b = std::min(sql.find('\n', std::min(pos, sql.size())), sql.size());
+        std::size_t e = b = std::min(b + 1, sql.size());
+        while (e < sql.size())
+        {
+            std::size_t eol = std::min(sql.find('\n', e), sql.size());
+            std::string line = sql.substr(e, eol - e);
+            if (line == "\\." || line == "\\.\r")
+            {
+                pos = eol;
+                break;
+            }
+            e = std::min(eol + 1, sql.size());
+        }
+        if (e == sql.size()) pos = std::string::npos;
+        out.begin_result();
+        s.query(stmt);
+        bool ok = s.get_state() == session::session_state::copy_in;
+        if (ok)
+        {
+            for (std::size_t off = b; off < e; off += 1 << 18)
+                s.copy_data(&sql[off], std::min<std::size_t>(1 << 18, e - off));
+            s.copy_done();
+            ok = s.get_transaction_status() != session::transaction_status::error;
+        }
+        report(ok);
+    }
+    while (s.pipeline_depth()) collect();
+    std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+    std::cerr << count << " statements, " << failed << " failed, in "
+              << dt.count() << " s" << std::endl;
+    return failed;
+}
+
+int usage(const char* prog)
+{
+    std::cerr << "Usage: " << prog << " [-f file] [-h host] [-p port] [-s socket_dir]"
+              << " [-d database] [-U user] [-E stop|continue] [-w depth] [-q] [conninfo]\n"
+              << "  Without -f, starts the interactive prompt. Use -f - to read stdin.\n"
+              << "  A connection URI or keyword/value string overrides -h, -p, -s, -d and -U.\n"
+              << "  -E stop (default) stops sending statements after the first error;\n"
+              << "  up to depth - 1 statements already sent will still run." << std::endl;
+    return 2;
+}
+
+int run_batch(const std::string& file, const std::string& conninfo,
+              const std::string& host, const std::string& port,
+              const std::string& dir, const std::string& database,
+              const std::string& user, const script_options& opts)
+{
+    std::string sql;
+    {
+        std::ifstream f;
+        std::istream* in = &std::cin;
+        if (file != "-")
+        {
+            f.open(file, std::ios::binary);
+            if (!f)
+            {
+                std::cerr << "Could not open " << file << std::endl;
+                return 1;
+            }
+            in = &f;
+        }
+        std::ostringstream ss;
+        ss << in->rdbuf();
+        sql = ss.str();
+    }
+    try
+    {
+        session s;
+        result_printer out;
+        if (!conninfo.empty()) s.connect(conninfo);
+        else
+        {
+            if (host.empty()) s.connect_local(port.empty() ? "5432" : port, dir);
+            else s.connect_tcp(host, port.empty() ? "postgresql" : port);
+            if (!s.startup(user, database))
+            {
+                print_notifications(s);
+                return 1;
+            }
+        }
+        s.clear_notification_queue();
+        return run_script(s, sql, opts, out) ? 3 : 0;
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    std::string file, host, port, dir = PGCLIENTLIB_SOCKET_DIR, database, user = default_user();
+    script_options opts;
+    int c;
+    while ((c = getopt(argc, argv, "f:h:p:s:d:U:E:w:q")) != -1)
+    {
+        switch (c)
+        {
+            case 'f': file = optarg; break;
+            case 'h': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 's': dir = optarg; break;
+            case 'd': database = optarg; break;
+            case 'U': user = optarg; break;
+            case 'E':
+            {
+                std::string e = optarg;
+                if (e != "stop" && e != "continue") return usage(argv[0]);
+                opts.stop_on_error = e == "stop";
+                break;
+            }
+            case 'w':
+            {
+                opts.depth = std::max(1, std::atoi(optarg));
+                break;
+            }
+            case 'q': opts.quiet = true; break;
+            default: return usage(argv[0]);
+        }
+    }
+    if (optind + 1 < argc) return usage(argv[0]);
+    std::string conninfo = optind < argc ? argv[optind] : "";
+    if (!file.empty())
+        return run_batch(file, conninfo, host, port, dir, database, user, opts);
+
     linenoise::LoadHistory(".history");
     
     session s;
+    result_printer out;
+    interrupt_handler interrupt(s);
     int max_rows = 10;
     std::string prompt = "> ";
+    auto connect = [&](const std::string& info)
+    {
+        auto co = connection_options::parse(info);
+        s.connect(co);
+        std::string database = co.dbname;
+        if (database.empty()) database = co.user.empty() ? default_user() : co.user;
+        std::cout << "Connected to " << database << std::endl;
+        prompt = database + "> ";
+    };
+    if (!conninfo.empty())
+    {
+        try { connect(conninfo); }
+        catch(const std::exception& e)
+        {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
     while(true)
     {
         std::string line, input;
@@ -112,12 +917,46 @@ int main()
             if (line[0] == '\\')
                 switch(line[1])
                 {
+                    case 'a':
+                    {
+                        using fmt = result_printer::output_format;
+                        auto pars = tokenize(line);
+                        std::string f = get_par(pars, 1, "");
+                        if (f.empty())
+                            f = out.get_format() == fmt::aligned ? "unaligned" : "aligned";
+                        if (f == "aligned") out.set_format(fmt::aligned);
+                        else if (f == "unaligned") out.set_format(fmt::unaligned);
+                        else if (f == "csv") out.set_format(fmt::csv);
+                        else if (f == "tsv") out.set_format(fmt::tsv);
+                        else
+                        {
+                            std::cout << "Format must be one of aligned, unaligned, csv or tsv" << std::endl;
+                            break;
+                        }
+                        out.begin_result();
+                        std::cout << "Output format is " << f << std::endl;
+                        break;
+                    }
+                    case 'C':
+                    {
+                        // Connect and start from a URI or keyword/value string
+                        connect(line.size() > 3 ? line.substr(3) : "");
+                        print_notifications(s);
+                        break;
+                    }
                     case 'c':
                     {
                         auto pars = tokenize(line);
+                        if (pars[0] == "\\copy")
+                        {
+                            auto cmd = parse_copy(line);
+                            if (cmd.from) copy_from_file(s, cmd, interrupt);
+                            else          copy_to_file(s, cmd, interrupt);
+                            break;
+                        }
                         std::string
                             port = get_par(pars, 1, "5432"),
-                            path = get_par(pars, 2, "/private/tmp"),
+                            path = get_par(pars, 2, PGCLIENTLIB_SOCKET_DIR),
                             prefix = get_par(pars, 3, ".s.PGSQL.");
                         s.connect_local(port, path, prefix);
                         std::cout << "Local connection on " << path << "/" << prefix << port << std::endl;
@@ -126,7 +965,7 @@ int main()
                     case 'd':
                     {
                         s.copy_done();
-                        print_notifications(s);
+                        print_completion(s);
                         break;
                     }
                     case 'e':
@@ -157,19 +996,15 @@ int main()
                         }
                         else
                         {
-                            for (int i = 0; i != max_rows; ++i)
-                            {
-                                if (s.row_queue_empty()) break;
-                                print_row(s);
-                            }
+                            out.print_rows(s, max_rows > 0 ? max_rows : 0);
                         }
                         break;
                     }
                     case 'i':
                     {
-                        auto pars = tokenize(line);
-                        std::string data = get_par(pars, 1, "");
-                        s.copy_data(data);
+                        // Send the rest of the line, spaces included, as one row
+                        std::string data = line.size() > 3 ? line.substr(3) : "";
+                        s.copy_data(data + "\n");
                         break;
                     }
                     case 'm':
@@ -180,6 +1015,15 @@ int main()
                         print_notifications(s);
                         break;
                     }
+                    case 'o':
+                    {
+                        auto pars = tokenize(line);
+                        std::string path = get_par(pars, 1, "");
+                        out.redirect(path);
+                        if (!path.empty())
+                            std::cout << "Output to " << path << std::endl;
+                        break;
+                    }
                     case 'p':
                     {
                         auto i = s.parameters();
@@ -204,7 +1048,7 @@ int main()
                     {
                         auto pars = tokenize(line);
                         std::string
-                            user = get_par(pars, 2, getlogin()),
+                            user = get_par(pars, 2, default_user()),
                             database = get_par(pars, 1, "");
                         s.startup(user, database);
                         if (database.empty()) database = user;
@@ -235,12 +1079,32 @@ int main()
                 }
             else
             {
-                s.query(line);
-                print_notifications(s);
+                // Show the first page as soon as it arrives, then either
+                // keep streaming (\m 0) or queue the rest for \g
+                interrupt_handler::guard g(interrupt);
+                std::size_t page = max_rows > 0 ? max_rows : 0;
+                out.begin_result();
+                s.start_query(line);
+                bool more = s.fetch(page ? page : 1024);
+                out.print_rows(s, page);
+                out.flush();
+                while (more)
+                {
+                    if (page)
+                    {
+                        more = s.fetch(std::numeric_limits<std::size_t>::max());
+                        break;
+                    }
+                    more = s.fetch(1024);
+                    out.print_rows(s, 0);
+                }
+                print_completion(s);
             }
+            out.flush();
         }
         catch(const std::runtime_error& e)
         {
+            out.flush();
             std::cout << "Caught exception: " << e.what() << std::endl;
         }
         catch(...)
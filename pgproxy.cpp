@@ -0,0 +1,337 @@
+//
+//  pgproxy.cpp
+//  pgclientlib
+//
+// MIT License
+//
+// Copyright (c) 2017 Timothy H. Keitt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+// Transaction-pooling proxy. Clients speak protocol v3 to the proxy, which
+// lends each of them a server session from a small pool for the duration
+// of a transaction. Only message framing is parsed; rows and copy data are
+// forwarded as raw bytes. Each client is served by its own thread with
+// blocking I/O on its socket and on the borrowed server session.
+//
+// Limitations: clients are not authenticated (the proxy connects to the
+// server with its own credentials), named prepared statements and session
+// state do not survive across transactions.
+
+#include <atomic>
+#include <random>
+#include <thread>
+#include <unistd.h>
+
+#include "pgclientlib.hpp"
+
+using namespace pgclientlib;
+using buffer_type = session::buffer_type;
+using tcp = asio::ip::tcp;
+
+/**
+ * A connected client and the server session it holds, if any.
+ */
+struct client
+{
+    std::mutex m;
+    session* server = nullptr;
+    std::int32_t key = 0;
+};
+
+// Relayed replies are written to the client in batches of about this size
+const std::size_t reply_batch_size = 64 * 1024;
+
+std::mutex registry_mtx;
+std::unordered_map<std::int32_t, std::shared_ptr<client>> registry;
+
+void
+put_int32(buffer_type& msg, std::int32_t x)
+{
+    boost::endian::big_int32_t v = x;
+    auto p = reinterpret_cast<const std::uint8_t*>(&v);
+    msg.insert(msg.end(), p, p + 4);
+}
+
+void
+put_msg(buffer_type& out, char code, const buffer_type& body)
+{
+    out.push_back(code);
+    put_int32(out, body.size() + 4);
+    out.insert(out.end(), body.begin(), body.end());
+}
+
+void
+put_str(buffer_type& msg, const std::string& x)
+{
+    msg.insert(msg.end(), x.begin(), x.end());
+    msg.push_back(0);
+}
+
+void
+send_error(tcp::socket& sock, const std::string& text)
+{
+    buffer_type body, msg;
+    body.push_back('S'); put_str(body, "FATAL");
+    body.push_back('C'); put_str(body, "08006");
+    body.push_back('M'); put_str(body, text);
+    body.push_back(0);
+    put_msg(msg, 'E', body);
+    asio::error_code ec;
+    asio::write(sock, asio::buffer(msg), ec);
+}
+
+// Read one framed client message into buf
+char
+read_message(tcp::socket& sock, buffer_type& buf)
+{
+    buf.resize(5);
+    asio::read(sock, asio::buffer(buf));
+    boost::endian::big_int32_t len;
+    std::memcpy(&len, &buf[1], 4);
+    if (len < 4) throw std::runtime_error("Invalid message length");
+    buf.resize(len + 1);
+    asio::read(sock, asio::buffer(&buf[5], len - 4));
+    return buf[0];
+}
+
+/**
+ * Handle the startup packet. Returns false if the connection was only a
+ * cancel request.
+ */
+bool
+startup(tcp::socket& sock, const buffer_type& greeting, client& c, std::int32_t id)
+{
+    buffer_type buf;
+    while (true)
+    {
+        boost::endian::big_int32_t len, code;
+        asio::read(sock, asio::buffer(&len, 4));
+        if (len < 8 || len > 10000) throw std::runtime_error("Invalid startup packet");
+        buf.resize(len - 4);
+        asio::read(sock, asio::buffer(buf));
+        std::memcpy(&code, &buf[0], 4);
+        if (code == 80877103 || code == 80877104) // SSLRequest, GSSENCRequest
+        {
+            asio::write(sock, asio::buffer("N", 1));
+            continue;
+        }
+        if (code == 80877102) // CancelRequest
+        {
+            boost::endian::big_int32_t pid, key;
+            std::memcpy(&pid, &buf[4], 4);
+            std::memcpy(&key, &buf[8], 4);
+            std::shared_ptr<client> target;
+            {
+                std::lock_guard<std::mutex> lock(registry_mtx);
+                auto i = registry.find(pid);
+                if (i != registry.end()) target = i->second;
+            }
+            if (target)
+            {
+                std::lock_guard<std::mutex> lock(target->m);
+                if (target->key == key && target->server) target->server->cancel();
+            }
+            return false;
+        }
+        if (code != 196608) throw std::runtime_error("Unsupported protocol version");
+        break;
+    }
+    buffer_type out = greeting, body;
+    put_int32(body, id);
+    put_int32(body, c.key);
+    put_msg(out, 'K', body);
+    put_msg(out, 'Z', {'I'});
+    asio::write(sock, asio::buffer(out));
+    return true;
+}
+
+void
+serve(tcp::socket sock, session_pool& pool, const buffer_type& greeting, std::int32_t id)
+{
+    auto c = std::make_shared<client>();
+    c->key = std::random_device()();
+    {
+        std::lock_guard<std::mutex> lock(registry_mtx);
+        registry[id] = c;
+    }
+    session_pool::lease server;
+    auto attach = [&](session* s)
+    {
+        std::lock_guard<std::mutex> lock(c->m);
+        c->server = s;
+    };
+    try
+    {
+        sock.set_option(tcp::no_delay(true));
+        if (startup(sock, greeting, *c, id))
+        {
+            buffer_type in, out, reply_msg;
+            // Extended-protocol messages sent whose replies are not yet relayed
+            std::size_t unanswered = 0;
+            while (true)
+            {
+                char code = read_message(sock, in);
+                if (code == 'X') break;
+                if (!server)
+                {
+                    server = pool.acquire();
+                    attach(&*server);
+                }
+                server->write_raw(in.data(), in.size());
+                if (code == 'P' || code == 'B' || code == 'D' || code == 'E' || code == 'C')
+                    ++unanswered;
+                bool flush = code == 'H' && unanswered;
+                if (code != 'Q' && code != 'S' && !flush) continue;
+                // Relay replies until the server is ready for the next
+                // request, or after a Flush until each message sent has its
+                // reply, batching them so rows do not cost a write each
+                out.clear();
+                std::uint8_t reply;
+                while (true)
+                {
+                    reply = server->read_raw(reply_msg);
+                    out.insert(out.end(), reply_msg.begin(), reply_msg.end());
+                    bool copy_in = reply == 'G' || reply == 'W'; // CopyIn, CopyBoth
+                    bool answered = false;
+                    if (flush)
+                    {
+                        switch (reply)
+                        {
+                            // The last reply to Parse, Bind, Close, Describe or Execute
+                            case '1': case '2': case '3': case 'T': case 'n':
+                            case 'C': case 'I': case 's':
+                                answered = --unanswered == 0;
+                                break;
+                            // The server skips the rest until Sync
+                            case 'E':
+                                unanswered = 0;
+                                answered = true;
+                                break;
+                        }
+                    }
+                    if (reply == 'Z' || answered || copy_in || out.size() >= reply_batch_size)
+                    {
+                        asio::write(sock, asio::buffer(out));
+                        out.clear();
+                    }
+                    if (copy_in)
+                    {
+                        char cc;
+                        do
+                        {
+                            cc = read_message(sock, in);
+                            server->write_raw(in.data(), in.size());
+                        }
+                        while (cc != 'c' && cc != 'f');
+                    }
+                    if (reply == 'Z' || answered) break;
+                }
+                if (reply != 'Z') continue;
+                unanswered = 0;
+                if (server->get_transaction_status() == session::transaction_status::idle)
+                {
+                    attach(nullptr);
+                    server.release();
+                }
+            }
+        }
+    }
+    catch(const std::exception& e)
+    {
+        send_error(sock, std::string("proxy: ") + e.what());
+    }
+    attach(nullptr);
+    server.release();
+    std::lock_guard<std::mutex> lock(registry_mtx);
+    registry.erase(id);
+}
+
+int
+usage(const char* prog)
+{
+    std::cerr << "Usage: " << prog << " [-l listen_port] [-n pool_size] [-h host] [-p port]"
+              << " [-s socket_dir] [-d database] [-U user]" << std::endl;
+    return 2;
+}
+
+int
+main(int argc, char* argv[])
+{
+    std::string listen = "6432", host, port, dir = PGCLIENTLIB_SOCKET_DIR, database;
+    std::string user = std::getenv("USER") ? std::getenv("USER") : "postgres";
+    std::size_t pool_size = 10;
+    int c;
+    while ((c = getopt(argc, argv, "l:n:h:p:s:d:U:")) != -1)
+    {
+        switch (c)
+        {
+            case 'l': listen = optarg; break;
+            case 'n': pool_size = std::max(1, std::atoi(optarg)); break;
+            case 'h': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 's': dir = optarg; break;
+            case 'd': database = optarg; break;
+            case 'U': user = optarg; break;
+            default: return usage(argv[0]);
+        }
+    }
+    session_pool pool([=](session& s)
+                      {
+                          if (host.empty()) s.connect_local(port.empty() ? "5432" : port, dir);
+                          else s.connect_tcp(host, port.empty() ? "postgresql" : port);
+                          if (!s.startup(user, database))
+                              throw std::runtime_error("Server refused startup");
+                      }, pool_size);
+    try
+    {
+        pool.warm_up(pool_size);
+        // Clients get the server's parameters as of the first connection
+        buffer_type greeting;
+        put_msg(greeting, 'R', {0, 0, 0, 0});
+        {
+            auto s = pool.acquire();
+            auto pars = s->parameters();
+            for (; pars.first != pars.second; ++pars.first)
+            {
+                buffer_type body;
+                put_str(body, pars.first->first);
+                put_str(body, pars.first->second);
+                put_msg(greeting, 'S', body);
+            }
+        }
+        asio::io_service io_service;
+        tcp::acceptor acceptor(io_service, tcp::endpoint(tcp::v4(), std::stoi(listen)));
+        std::cerr << "Listening on port " << listen << " with " << pool_size
+                  << " server sessions" << std::endl;
+        std::int32_t next_id = 1;
+        while (true)
+        {
+            tcp::socket sock(io_service);
+            acceptor.accept(sock);
+            std::thread(serve, std::move(sock), std::ref(pool), std::cref(greeting), next_id++).detach();
+        }
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}